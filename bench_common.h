@@ -0,0 +1,750 @@
+// Benchmark harness shared by conv_test, linearize_test and pixel_test. Each
+// driver is a single translation unit that includes this once, sets
+// bench_opts.kernel and passes its pipelines to test_performance/stream_variants.
+//
+// Options accepted after the image path by every driver:
+//   --profile          compile with Target::Profile and merge per-Func times into renders/*_<kernel>.json
+//   --profile-stages   as --profile, but compute_root the intermediates so each one is reported separately
+//   --trace FILE       compile with TraceLoads/TraceStores and write a binary trace (HalideTraceViz format) to FILE
+//   --no-pool          let the runtime use its own halide_malloc/halide_free instead of the buffer pool
+//   --huge-pages       back large pool blocks with transparent huge pages (Linux)
+//   --iters N          timed iterations per pipeline (default 1000)
+//   --stream WxHxC     treat the path as raw interleaved 8-bit frames (or - for stdin) and stream them
+//                      through each variant; also --ring N, --fps F, --deadline MS, --variant NAME and
+//                      --stream-out FILE (see test_streaming)
+//
+// Build with -DBENCH_COUNT_HEAP_CALLS (glibc only) to also count every heap
+// call the process makes during the timed loop; see process_heap_calls.
+
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include "Halide.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+
+#include "halide_image_io.h"
+
+using namespace Halide;
+using namespace Halide::Tools;
+using namespace std::chrono;
+
+struct BenchOptions {
+    // Name of the driver's kernel; results go to renders/<variant>_<kernel>.*
+    std::string kernel;
+    bool profile = false;
+    bool profile_stages = false;
+    std::string trace_file;
+    bool pool = true;
+    bool huge_pages = false;
+    int stream_width = 0, stream_height = 0, stream_channels = 0;
+    int ring = 3;
+    double fps = 0;
+    double deadline_ms = 0;
+    std::string variant;
+    std::string stream_out;
+    int iterations = 1000;
+};
+
+BenchOptions bench_opts;
+
+// The target of the most recent bench_target() call, i.e. the one the
+// pipeline about to be benchmarked was compiled for.
+std::string compiled_target;
+
+// Add the profiling/tracing features requested on the command line.
+Target bench_target(Target target) {
+    if (bench_opts.profile) {
+        target = target.with_feature(Target::Profile);
+    }
+    if (!bench_opts.trace_file.empty()) {
+        target = target.with_feature(Target::TraceLoads).with_feature(Target::TraceStores);
+    }
+    compiled_target = target.to_string();
+    return target;
+}
+
+// Options that change what a result measures, recorded with it so
+// scripts/history.py never compares runs made under different settings.
+std::string bench_flags() {
+    std::string flags;
+    auto add = [&](const std::string &flag) { flags += (flags.empty() ? "" : ",") + flag; };
+    if (bench_opts.profile_stages) {
+        add("profile-stages");
+    } else if (bench_opts.profile) {
+        add("profile");
+    }
+    if (!bench_opts.trace_file.empty()) add("trace");
+    if (!bench_opts.pool) add("no-pool");
+    if (bench_opts.huge_pages) add("huge-pages");
+#ifdef BENCH_COUNT_HEAP_CALLS
+    add("count-heap-calls");
+#endif
+    if (bench_opts.stream_width > 0) {
+        add("ring=" + std::to_string(bench_opts.ring));
+        if (bench_opts.fps > 0) add("fps=" + std::to_string(bench_opts.fps));
+        if (bench_opts.deadline_ms > 0) add("deadline=" + std::to_string(bench_opts.deadline_ms));
+    }
+    return flags;
+}
+
+// The commit the benchmark ran at, with -dirty appended when a driver source
+// or this header has local changes; empty outside a git checkout. Recorded
+// with every result so scripts/history.py files it under the commit that
+// produced it rather than whatever is checked out when it's recorded.
+std::string bench_commit() {
+    static std::string commit;
+    static bool queried = false;
+    if (queried) return commit;
+    queried = true;
+    FILE *git = popen("git rev-parse HEAD 2>/dev/null", "r");
+    if (!git) return commit;
+    char line[64];
+    if (fgets(line, sizeof(line), git)) commit = line;
+    pclose(git);
+    commit.erase(commit.find_last_not_of(" \n") + 1);
+    if (!commit.empty() && system("git diff --quiet HEAD -- ':(top)*.cpp' ':(top)*.h' 2>/dev/null") != 0) {
+        commit += "-dirty";
+    }
+    return commit;
+}
+
+// Profiled and traced runs don't measure the plain schedule, so their
+// results get their own files instead of overwriting the normal ones.
+std::string result_name(const std::string &oname) {
+    std::string name = oname;
+    if (!bench_opts.trace_file.empty()) {
+        name += "_trace";
+    } else if (bench_opts.profile) {
+        name += "_profile";
+    }
+    return name + "_" + bench_opts.kernel;
+}
+
+// Consume the option at argv[i] (and its argument, if any). Returns false for
+// options this header doesn't know about, so a driver can handle its own.
+bool parse_bench_option(int argc, char **argv, int &i) {
+    std::string arg = argv[i];
+    if (arg == "--profile") {
+        bench_opts.profile = true;
+    } else if (arg == "--profile-stages") {
+        bench_opts.profile = true;
+        bench_opts.profile_stages = true;
+    } else if (arg == "--trace" && i + 1 < argc) {
+        bench_opts.trace_file = argv[++i];
+        // The runtime's default trace handler writes binary packets to this file.
+        setenv("HL_TRACE_FILE", bench_opts.trace_file.c_str(), 1);
+    } else if (arg == "--no-pool") {
+        bench_opts.pool = false;
+    } else if (arg == "--huge-pages") {
+        bench_opts.huge_pages = true;
+    } else if (arg == "--iters" && i + 1 < argc) {
+        bench_opts.iterations = std::max(atoi(argv[++i]), 1);
+    } else if (arg == "--stream" && i + 1 < argc) {
+        if (sscanf(argv[++i], "%dx%dx%d", &bench_opts.stream_width, &bench_opts.stream_height,
+                   &bench_opts.stream_channels) != 3) {
+            printf("--stream expects WxHxC, got %s\n", argv[i]);
+            return false;
+        }
+    } else if (arg == "--ring" && i + 1 < argc) {
+        bench_opts.ring = std::max(atoi(argv[++i]), 1);
+    } else if (arg == "--fps" && i + 1 < argc) {
+        bench_opts.fps = atof(argv[++i]);
+    } else if (arg == "--deadline" && i + 1 < argc) {
+        bench_opts.deadline_ms = atof(argv[++i]);
+    } else if (arg == "--variant" && i + 1 < argc) {
+        bench_opts.variant = argv[++i];
+    } else if (arg == "--stream-out" && i + 1 < argc) {
+        bench_opts.stream_out = argv[++i];
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Every heap call the whole process makes, when built with
+// BENCH_COUNT_HEAP_CALLS. The executable's own malloc/free wrappers below then
+// take precedence over libc's, so this also sees operator new, libHalide, the
+// JIT runtime and the pool's bookkeeping, which the pool's counters can't.
+// Each call pays for an atomic increment, so it's off by default and results
+// from a counting build are flagged as such.
+std::atomic<size_t> process_heap_calls(0);
+
+#ifdef BENCH_COUNT_HEAP_CALLS
+#ifndef __GLIBC__
+#error "BENCH_COUNT_HEAP_CALLS wraps glibc's allocator entry points"
+#endif
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size) __THROW {
+    process_heap_calls++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) __THROW {
+    process_heap_calls++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) __THROW {
+    process_heap_calls++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) __THROW {
+    if (ptr) process_heap_calls++;
+    __libc_free(ptr);
+}
+
+void *memalign(size_t alignment, size_t size) __THROW {
+    process_heap_calls++;
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) __THROW {
+    process_heap_calls++;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) __THROW {
+    process_heap_calls++;
+    void *p = __libc_memalign(alignment, size);
+    if (!p && size) return ENOMEM;
+    *out = p;
+    return 0;
+}
+}
+#endif
+
+// Allocator handed to the JIT runtime in place of halide_malloc/halide_free.
+// Requests are rounded up to a power-of-two size class and freed blocks go
+// back on that class's free list instead of to the system, so once the
+// warmup has populated every class a schedule uses, the runtime's scratch
+// buffers stop hitting the heap.
+class BufferPool {
+public:
+    // The alignment halide_malloc guarantees, which the runtime relies on.
+    static const size_t alignment = 128;
+    static const int min_class = 6, num_classes = 48;
+
+    size_t requests = 0;
+    size_t system_allocs = 0;
+
+    void *allocate(size_t size) {
+        int cls = min_class;
+        while (cls < num_classes && ((size_t)1 << cls) < size) cls++;
+        if (cls == num_classes) return nullptr;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        requests++;
+        if (!free_lists[cls].empty()) {
+            char *block = free_lists[cls].back();
+            free_lists[cls].pop_back();
+            return block;
+        }
+        char *block = system_alloc((size_t)1 << cls);
+        if (!block) return nullptr;
+        system_allocs++;
+        block_class[block] = cls;
+        return block;
+    }
+
+    void release(void *ptr) {
+        if (!ptr) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        free_lists[block_class.at((char *)ptr)].push_back((char *)ptr);
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<char *> free_lists[num_classes];
+    // Size class of every block handed out. It's kept here rather than in a
+    // header in front of the block, so a huge-page block is exactly its class
+    // size and starts on a page boundary.
+    std::map<char *, int> block_class;
+
+    char *system_alloc(size_t bytes) {
+        const size_t huge_page = 2 << 20;
+        if (bench_opts.huge_pages && bytes >= huge_page) {
+            // Classes this big are whole huge pages. mmap only promises 4K
+            // alignment, so map one page extra and trim the block down to an
+            // aligned run that THP can back from its first byte.
+            void *p = mmap(nullptr, bytes + huge_page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) return nullptr;
+            char *start = (char *)p;
+            char *block = (char *)(((uintptr_t)start + huge_page - 1) & ~(uintptr_t)(huge_page - 1));
+            if (block > start) munmap(start, block - start);
+            munmap(block + bytes, start + huge_page - block);
+#ifdef MADV_HUGEPAGE
+            madvise(block, bytes, MADV_HUGEPAGE);
+#endif
+            return block;
+        }
+        void *p = nullptr;
+        if (posix_memalign(&p, alignment, bytes) != 0) return nullptr;
+        return (char *)p;
+    }
+};
+
+BufferPool buffer_pool;
+
+void *pool_malloc(void *user_context, size_t size) {
+    return buffer_pool.allocate(size);
+}
+
+void pool_free(void *user_context, void *ptr) {
+    buffer_pool.release(ptr);
+}
+
+// Outputs are shared by every test_performance call with the same shape, so
+// back-to-back runs don't reallocate them.
+Buffer<uint8_t> pooled_output(int width, int height, int channels) {
+    static std::map<std::vector<int>, Buffer<uint8_t>> outputs;
+    Buffer<uint8_t> &output = outputs[{width, height, channels}];
+    if (!output.defined()) {
+        output = Buffer<uint8_t>(width, height, channels);
+    }
+    return output;
+}
+
+// Everything the Halide runtime prints while profiling; the profiler report
+// for each realize() arrives here through halide_print.
+std::string profile_log;
+
+void capture_print(void *user_context, const char *msg) {
+    profile_log += msg;
+}
+
+struct StageProfile {
+    double time_ms = 0;
+    double threads = 0;
+    long long peak_bytes = 0;
+    long long allocs = 0;
+    int reports = 0;
+};
+
+struct PipelineProfile {
+    int runs = 0;
+    double time_ms = 0;
+    double threads = 0;
+    int thread_reports = 0;
+    long long heap_allocs = 0;
+    long long peak_heap_bytes = 0;
+    std::map<std::string, StageProfile> stages;
+};
+
+// The number following key in a profiler report line, or -1 if it isn't there.
+double field_after(const std::string &line, const std::string &key) {
+    size_t pos = line.find(key);
+    if (pos == std::string::npos) return -1;
+    return atof(line.c_str() + pos + key.size());
+}
+
+// JIT realize() prints and resets the profiler after every run, so the log
+// holds one report per realize; sum them up here. A report opens with the
+// pipeline totals: a "total time:" line carrying "time/run:", an "average
+// threads used:" line and a "heap allocations:" line carrying "peak heap
+// usage:". Every other line of the form "name: <time>ms ..." is a stage,
+// with optional "threads:", "peak:" and "num:" fields after it. Indentation
+// and column padding vary between Halide versions, so don't rely on them.
+PipelineProfile parse_profile(const std::string &log) {
+    PipelineProfile p;
+    std::istringstream in(log);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.find("total time:") != std::string::npos) {
+            p.runs++;
+            p.time_ms += field_after(line, "time/run:");
+        } else if (line.find("average threads used:") != std::string::npos) {
+            p.threads += field_after(line, "average threads used:");
+            p.thread_reports++;
+        } else if (line.find("heap allocations:") != std::string::npos) {
+            p.heap_allocs += (long long)field_after(line, "heap allocations:");
+            p.peak_heap_bytes = std::max(p.peak_heap_bytes, (long long)field_after(line, "peak heap usage:"));
+        } else {
+            size_t colon = line.find(':');
+            size_t begin = line.find_first_not_of(' ');
+            if (colon == std::string::npos || begin >= colon) continue;
+            const char *time = line.c_str() + colon + 1;
+            char *end = nullptr;
+            double ms = strtod(time, &end);
+            if (end == time || strncmp(end, "ms", 2) != 0) continue;
+
+            StageProfile &s = p.stages[line.substr(begin, colon - begin)];
+            s.time_ms += ms;
+            s.threads += std::max(field_after(line, "threads:"), 0.0);
+            s.peak_bytes = std::max(s.peak_bytes, (long long)field_after(line, "peak:"));
+            s.allocs += std::max((long long)field_after(line, "num:"), 0LL);
+            s.reports++;
+        }
+    }
+    return p;
+}
+
+void write_profile_json(std::ofstream &out, const PipelineProfile &p) {
+    int runs = std::max(p.runs, 1);
+    out << "  \"profile\": {\n";
+    out << "    \"runs\": " << p.runs << ",\n";
+    out << "    \"time_per_run_ms\": " << p.time_ms / runs << ",\n";
+    out << "    \"average_threads\": " << (p.thread_reports ? p.threads / p.thread_reports : 1.0) << ",\n";
+    out << "    \"heap_allocations_per_run\": " << (double)p.heap_allocs / runs << ",\n";
+    out << "    \"peak_heap_bytes\": " << p.peak_heap_bytes << ",\n";
+    out << "    \"stages\": {";
+    const char *sep = "\n";
+    for (const auto &e : p.stages) {
+        const StageProfile &s = e.second;
+        int reports = std::max(s.reports, 1);
+        out << sep << "      \"" << e.first << "\": {"
+            << "\"time_per_run_ms\": " << s.time_ms / reports
+            << ", \"percent\": " << (p.time_ms > 0 ? 100.0 * s.time_ms / p.time_ms : 0.0)
+            << ", \"average_threads\": " << s.threads / reports
+            << ", \"peak_bytes\": " << s.peak_bytes
+            << ", \"allocations_per_run\": " << (double)s.allocs / reports << "}";
+        sep = ",\n";
+    }
+    out << "\n    }\n  }";
+}
+
+void test_performance(Buffer<uint8_t> input, Func lin, std::string oname) {
+    if (bench_opts.profile) {
+        lin.set_custom_print(capture_print);
+    }
+    if (bench_opts.pool) {
+        lin.set_custom_allocator(pool_malloc, pool_free);
+    }
+    Buffer<uint8_t> output = pooled_output(input.width(), input.height(), input.channels());
+    lin.realize(output);
+    output.copy_to_host();
+    save_image(output, result_name(oname) + ".png");
+    //lin.compile_to_lowered_stmt(result_name(oname) + ".html", lin.infer_arguments(), HTML);
+    
+    // warmup
+    // A traced run writes every load and store to the trace file, so one is plenty.
+    int n = bench_opts.trace_file.empty() ? bench_opts.iterations : 1;
+    for (int i = 0; i < n; i++) {
+        lin.realize(output);
+        output.copy_to_host();
+    }
+    profile_log.clear();
+    std::vector<double> v;
+    v.reserve(n);
+    size_t requests_before = buffer_pool.requests;
+    size_t system_allocs_before = buffer_pool.system_allocs;
+    size_t process_calls_before = process_heap_calls;
+    for (int i = 0; i < n; i++) {
+        high_resolution_clock::time_point t1 = high_resolution_clock::now();
+        lin.realize(output);
+        output.copy_to_host();
+        high_resolution_clock::time_point t2 = high_resolution_clock::now();
+
+        duration<double> time_span = duration_cast<duration<double>>(t2 - t1);
+        double avg_time = time_span.count();
+        v.push_back(avg_time);
+    }
+    size_t process_calls = process_heap_calls - process_calls_before;
+    double sum = std::accumulate(v.begin(), v.end(), 0.0);
+    double mean = sum / v.size();
+
+    double sq_sum = std::inner_product(v.begin(), v.end(), v.begin(), 0.0);
+    double stdev = std::sqrt(sq_sum / v.size() - mean * mean);
+    printf("Mean: %1.6f seconds\n", mean);
+    printf("Std dev: %1.6f seconds\n", stdev);
+    printf("N: %d\n", n);
+
+    // The pool sees the runtime's scratch buffers, i.e. every halide_malloc
+    // the pipeline makes. The process count also sees realize() itself, which
+    // builds its argument list on the heap on every call, so it can't reach
+    // zero through JIT realize. Once the pool is warm (no misses), that
+    // per-call overhead is all the process count is measuring.
+    double runtime_allocs_per_realize = (double)(buffer_pool.requests - requests_before) / n;
+    size_t pool_misses = buffer_pool.system_allocs - system_allocs_before;
+    if (bench_opts.pool) {
+        printf("Runtime scratch allocations per realize: %.2f (%zu missed the pool)\n", runtime_allocs_per_realize, pool_misses);
+    }
+#ifdef BENCH_COUNT_HEAP_CALLS
+    printf("Process heap calls per realize: %.2f (%s)\n", (double)process_calls / n,
+           !bench_opts.pool ? "runtime scratch and realize() overhead"
+                            : pool_misses ? "realize() overhead and pool misses" : "realize() overhead");
+#endif
+
+    PipelineProfile profile;
+    if (bench_opts.profile) {
+        profile = parse_profile(profile_log);
+        for (const auto &e : profile.stages) {
+            printf("  %-12s %8.4f ms/run (%5.1f%%)\n", e.first.c_str(),
+                   e.second.time_ms / std::max(e.second.reports, 1),
+                   profile.time_ms > 0 ? 100.0 * e.second.time_ms / profile.time_ms : 0.0);
+        }
+    }
+
+    if (oname != "") {
+        std::ofstream outFile(result_name(oname) + ".txt");
+        // the important part
+        for (const auto &e : v) outFile << e << "\n";
+
+        std::ofstream jsonFile(result_name(oname) + ".json");
+        jsonFile << "{\n";
+        jsonFile << "  \"kernel\": \"" << bench_opts.kernel << "\",\n";
+        jsonFile << "  \"variant\": \"" << oname.substr(oname.find_last_of('/') + 1) << "\",\n";
+        jsonFile << "  \"commit\": \"" << bench_commit() << "\",\n";
+        jsonFile << "  \"target\": \"" << compiled_target << "\",\n";
+        jsonFile << "  \"flags\": \"" << bench_flags() << "\",\n";
+        jsonFile << "  \"n\": " << n << ",\n";
+        jsonFile << "  \"mean\": " << mean << ",\n";
+        jsonFile << "  \"stdev\": " << stdev;
+        if (bench_opts.pool) {
+            jsonFile << ",\n";
+            jsonFile << "  \"runtime_allocations_per_realize\": " << runtime_allocs_per_realize << ",\n";
+            jsonFile << "  \"pool_misses\": " << pool_misses;
+        }
+#ifdef BENCH_COUNT_HEAP_CALLS
+        jsonFile << ",\n";
+        jsonFile << "  \"process_heap_calls_per_realize\": " << (double)process_calls / n;
+#endif
+        if (bench_opts.profile) {
+            jsonFile << ",\n";
+            write_profile_json(jsonFile, profile);
+        }
+        jsonFile << "\n}\n";
+    }
+}
+
+void test_performance(Buffer<uint8_t> input, Func lin) {
+    test_performance(input, lin, "");
+}
+
+// One entry in the streaming ring. Each slot owns its buffers and a copy of
+// the pipeline compiled against its input, so the reader can fill one slot
+// while another is being computed and a third is being written out.
+struct FrameSlot {
+    enum State { Empty, Loaded, Computed, Dropped };
+    State state = Empty;
+    Buffer<uint8_t> input, output;
+    Func lin;
+    high_resolution_clock::time_point arrival;
+};
+
+// Stream raw interleaved frames from path ("-" for stdin) through a ring of
+// preallocated slots: frame N+1 is read while frame N is computed and frame
+// N-1 is written. With --fps the reader is paced like a camera; otherwise a
+// frame arrives when it's read, which only means something for a live pipe.
+// With --deadline, frames that have waited longer than the deadline by the
+// time the pipeline is free are dropped, and ones that finish past it are
+// counted as late.
+void test_streaming(const std::string &path, std::function<Func(Buffer<uint8_t>)> make_pipeline, std::string oname) {
+    int width = bench_opts.stream_width, height = bench_opts.stream_height, channels = bench_opts.stream_channels;
+    size_t frame_bytes = (size_t)width * height * channels;
+
+    std::vector<FrameSlot> slots(bench_opts.ring);
+    for (FrameSlot &slot : slots) {
+        slot.input = Buffer<uint8_t>::make_interleaved(width, height, channels);
+        slot.output = Buffer<uint8_t>::make_interleaved(width, height, channels);
+        slot.lin = make_pipeline(slot.input);
+        if (bench_opts.pool) {
+            slot.lin.set_custom_allocator(pool_malloc, pool_free);
+        }
+        // warmup
+        slot.input.fill(0);
+        slot.lin.realize(slot.output);
+        slot.output.copy_to_host();
+    }
+
+    FILE *in = path == "-" ? stdin : fopen(path.c_str(), "rb");
+    if (!in) {
+        printf("Could not open %s\n", path.c_str());
+        return;
+    }
+    FILE *out = nullptr;
+    if (!bench_opts.stream_out.empty()) {
+        out = fopen(bench_opts.stream_out.c_str(), "wb");
+    }
+
+    std::mutex m;
+    std::condition_variable cv;
+    int frames_read = 0, dropped = 0, late = 0;
+    bool eof = false;
+    std::vector<double> latencies;
+    double deadline = bench_opts.deadline_ms / 1000.0;
+    high_resolution_clock::time_point start = high_resolution_clock::now();
+
+    std::thread reader([&] {
+        for (int f = 0;; f++) {
+            FrameSlot &slot = slots[f % slots.size()];
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv.wait(lock, [&] { return slot.state == FrameSlot::Empty; });
+            }
+            high_resolution_clock::time_point arrival = start;
+            if (bench_opts.fps > 0) {
+                arrival += duration_cast<high_resolution_clock::duration>(duration<double>(f / bench_opts.fps));
+                std::this_thread::sleep_until(arrival);
+            }
+            size_t got = fread(slot.input.data(), 1, frame_bytes, in);
+
+            std::lock_guard<std::mutex> lock(m);
+            if (got < frame_bytes) {
+                eof = true;
+                cv.notify_all();
+                return;
+            }
+            slot.arrival = bench_opts.fps > 0 ? arrival : high_resolution_clock::now();
+            slot.input.set_host_dirty();
+            slot.state = FrameSlot::Loaded;
+            frames_read++;
+            cv.notify_all();
+        }
+    });
+
+    std::thread writer([&] {
+        for (int f = 0;; f++) {
+            FrameSlot &slot = slots[f % slots.size()];
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [&] {
+                return slot.state == FrameSlot::Computed || slot.state == FrameSlot::Dropped || (eof && f >= frames_read);
+            });
+            if (slot.state == FrameSlot::Computed) {
+                lock.unlock();
+                if (out) fwrite(slot.output.data(), 1, frame_bytes, out);
+                double latency = duration<double>(high_resolution_clock::now() - slot.arrival).count();
+                lock.lock();
+                latencies.push_back(latency);
+                if (deadline > 0 && latency > deadline) late++;
+            } else if (slot.state != FrameSlot::Dropped) {
+                return;
+            }
+            slot.state = FrameSlot::Empty;
+            cv.notify_all();
+        }
+    });
+
+    for (int f = 0;; f++) {
+        FrameSlot &slot = slots[f % slots.size()];
+        {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [&] { return slot.state == FrameSlot::Loaded || (eof && f >= frames_read); });
+            if (slot.state != FrameSlot::Loaded) break;
+        }
+        bool drop = deadline > 0 && duration<double>(high_resolution_clock::now() - slot.arrival).count() > deadline;
+        if (!drop) {
+            slot.lin.realize(slot.output);
+            slot.output.copy_to_host();
+        }
+        std::lock_guard<std::mutex> lock(m);
+        slot.state = drop ? FrameSlot::Dropped : FrameSlot::Computed;
+        dropped += drop;
+        cv.notify_all();
+    }
+    reader.join();
+    writer.join();
+    double wall = duration<double>(high_resolution_clock::now() - start).count();
+
+    if (in != stdin) fclose(in);
+    if (out) fclose(out);
+
+    if (latencies.empty()) {
+        printf("No frames processed\n");
+        return;
+    }
+    std::vector<double> v = latencies;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) { return 1000.0 * latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))]; };
+    double mean = std::accumulate(v.begin(), v.end(), 0.0) / v.size();
+    double sq_sum = std::inner_product(v.begin(), v.end(), v.begin(), 0.0);
+    double stdev = std::sqrt(sq_sum / v.size() - mean * mean);
+    double fps = latencies.size() / wall;
+    printf("Frames: %d read, %zu written, %.1f fps sustained\n", frames_read, latencies.size(), fps);
+    printf("Latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           percentile(0.5), percentile(0.9), percentile(0.99), 1000.0 * latencies.back());
+    if (deadline > 0) {
+        printf("Deadline %.1f ms: %d dropped, %d late\n", bench_opts.deadline_ms, dropped, late);
+    }
+
+    if (oname != "") {
+        std::ofstream outFile(result_name(oname) + ".txt");
+        for (const auto &e : v) outFile << e << "\n";
+
+        std::ofstream jsonFile(result_name(oname) + ".json");
+        jsonFile << "{\n";
+        jsonFile << "  \"kernel\": \"" << bench_opts.kernel << "\",\n";
+        jsonFile << "  \"variant\": \"" << oname.substr(oname.find_last_of('/') + 1) << "\",\n";
+        jsonFile << "  \"commit\": \"" << bench_commit() << "\",\n";
+        jsonFile << "  \"target\": \"" << compiled_target << "\",\n";
+        jsonFile << "  \"flags\": \"" << bench_flags() << "\",\n";
+        jsonFile << "  \"n\": " << v.size() << ",\n";
+        jsonFile << "  \"mean\": " << mean << ",\n";
+        jsonFile << "  \"stdev\": " << stdev << ",\n";
+        jsonFile << "  \"fps\": " << fps << ",\n";
+        jsonFile << "  \"latency_ms\": {\"p50\": " << percentile(0.5) << ", \"p90\": " << percentile(0.9)
+                 << ", \"p99\": " << percentile(0.99) << ", \"max\": " << 1000.0 * latencies.back() << "},\n";
+        jsonFile << "  \"ring\": " << slots.size() << ",\n";
+        jsonFile << "  \"deadline_ms\": " << bench_opts.deadline_ms << ",\n";
+        jsonFile << "  \"dropped\": " << dropped << ",\n";
+        jsonFile << "  \"late\": " << late << "\n";
+        jsonFile << "}\n";
+    }
+}
+
+// The ring slots are interleaved (channel stride 1), but Halide constrains an
+// output's x stride to 1 unless told otherwise, and its default loop nest has
+// c outermost, which would sweep each frame once per channel with x striding
+// by the channel count. Relax the constraint and put the (bounded, unrolled)
+// channels innermost so each frame is written in one pass in memory order.
+// Must be called before the pipeline is scheduled and compiled.
+void schedule_interleaved(Func lin, Var x, Var y, Var c) {
+    lin.output_buffer().dim(0).set_stride(Expr()).dim(2).set_stride(1);
+    lin.reorder(c, x, y)
+        .bound(c, 0, bench_opts.stream_channels)
+        .unroll(c);
+}
+
+// Stream every variant (or only --variant) over the raw frames in path.
+template<typename BranchPipeline, typename MaskPipeline>
+void stream_variants(const std::string &path) {
+    struct Variant {
+        std::string name;
+        std::function<Func(Buffer<uint8_t>)> make;
+    };
+    std::vector<Variant> variants = {
+        {"cpu_branch", [](Buffer<uint8_t> in) { BranchPipeline p(in); schedule_interleaved(p.lin, p.x, p.y, p.c); p.schedule_for_cpu(); return p.lin; }},
+        {"cpu_pred", [](Buffer<uint8_t> in) { MaskPipeline p(in); schedule_interleaved(p.lin, p.x, p.y, p.c); p.schedule_for_cpu(); return p.lin; }},
+        {"gpu_branch", [](Buffer<uint8_t> in) { BranchPipeline p(in); schedule_interleaved(p.lin, p.x, p.y, p.c); p.schedule_for_gpu(); return p.lin; }},
+        {"gpu_pred", [](Buffer<uint8_t> in) { MaskPipeline p(in); schedule_interleaved(p.lin, p.x, p.y, p.c); p.schedule_for_gpu(); return p.lin; }},
+    };
+    if (path == "-" && bench_opts.variant.empty()) {
+        printf("A stream from stdin can only be read once; pick one with --variant\n");
+        return;
+    }
+    // Without --fps a frame "arrives" when the reader gets to it, and from a
+    // file that's only when a slot frees up, so the deadline would measure
+    // queueing in the ring rather than keeping up with a source.
+    if (path != "-" && bench_opts.deadline_ms > 0 && bench_opts.fps <= 0) {
+        printf("--deadline on a file needs --fps to give frames an arrival time\n");
+        return;
+    }
+    for (const Variant &variant : variants) {
+        if (!bench_opts.variant.empty() && variant.name != bench_opts.variant) continue;
+        printf("%s streaming (ring of %d):\n", variant.name.c_str(), bench_opts.ring);
+        test_streaming(path, variant.make, "renders/" + variant.name + "_stream");
+    }
+}
+
+#endif  // BENCH_COMMON_H
@@ -4,6 +4,10 @@
 // g++ conv_test.cpp -g -I ~/Halide10/include/ -I ~/Halide10/share/Halide/tools/ -L ~/Halide10/lib/ -lHalide `libpng-config --cflags --ldflags` -ljpeg -lpthread -ldl -o conv_test -std=c++11
 // LD_LIBRARY_PATH=~/Halide10/lib/ ./conv_test images/rgb.png
 
+// Options after the image path are listed in bench_common.h.
+// --stencil benchmarks the K x K stencil pipelines across radii instead of the 5-point ones
+// (large-radius direct stencils want --iters 100 or so).
+
 #include "Halide.h"
 
 #include <chrono>
@@ -11,6 +15,8 @@
 
 // Include some support code for loading pngs.
 #include "halide_image_io.h"
+// Options, profiling, the buffer pool and the timing/streaming harness.
+#include "bench_common.h"
 // #include <filesystem>
 #include <string>
 #include <iostream>
@@ -58,11 +64,11 @@ Target find_gpu_target() {
 
 class ConvMaskPipeline {
 public:
-    Func lin;
+    Func lin, mask, less, greater, inpb;
     Var x, y, c, x_outer, x_inner, y_outer, y_inner;
     Buffer<uint8_t> input;
-    ConvMaskPipeline(Buffer<uint8_t> in) : input(in) {
-        Func mask, less, greater;
+    ConvMaskPipeline(Buffer<uint8_t> in)
+        : lin("lin"), mask("mask"), less("less"), greater("greater"), inpb("inpb"), input(in) {
         Expr value = input(x, y, c);
 
         Expr threshold = 0.5f;
@@ -72,7 +78,7 @@ public:
 
         value = value / 255.0f;
 
-        Func inpb = BoundaryConditions::repeat_edge(input);
+        inpb(x, y, c) = BoundaryConditions::repeat_edge(input)(x, y, c);
 
         mask(x, y, c) = cast<float>(value > threshold);//select(value <= threshold, 0, 1);
         less(x, y, c) = 0.2f * (inpb(x, y, c)
@@ -89,17 +95,30 @@ public:
         lin(x, y, c) = cast<uint8_t>(min(mask(x, y, c) * greater(x, y, c) + (1.0f - mask(x, y, c)) * less(x, y, c), 255.0f));
     }
 
+    // Inlined Funcs are folded into lin by the profiler, so give every
+    // intermediate its own buffer to see what each stage costs on its own.
+    void materialize_stages() {
+        inpb.compute_root();
+        mask.compute_root();
+        less.compute_root();
+        greater.compute_root();
+    }
+
     bool schedule_for_cpu() {
         // lin.reorder(c, x, y)
         //     .bound(c, 0, 3)
         //     .unroll(c);
         // Var x_outer, x_inner, y_outer, y_inner;
         // lin.tile(x, y, x_outer, y_outer, x_inner, y_inner, 4, 4);
+
+        lin.compile_jit(bench_target(get_jit_target_from_environment()));
+        return true;
     }
 
     bool schedule_for_gpu() {
         Target target = find_gpu_target();
         if (!target.has_gpu_feature()) {
+            lin.compile_jit(bench_target(target));
             return false;
         }
 
@@ -114,16 +133,17 @@ public:
 
         //lin.gpu_tile(x, y, x_outer, y_outer, x_inner, y_inner, 8, 8);
 
-        lin.compile_jit(target);
+        lin.compile_jit(bench_target(target));
+        return true;
     }
 };
 
 class ConvBranchPipeline {
 public:
-    Func lin;
+    Func lin, inpb;
     Var x, y, c, x_outer, x_inner, y_outer, y_inner;
     Buffer<uint8_t> input;
-    ConvBranchPipeline(Buffer<uint8_t> in) : input(in) {
+    ConvBranchPipeline(Buffer<uint8_t> in) : lin("lin"), inpb("inpb"), input(in) {
         
         Expr value = input(x, y, c);
 
@@ -134,7 +154,7 @@ public:
 
         value = value / 255.0f;
 
-        Func inpb = BoundaryConditions::repeat_edge(input);
+        inpb(x, y, c) = BoundaryConditions::repeat_edge(input)(x, y, c);
 
         lin(x, y, c) = cast<uint8_t>(min(select(value <= threshold, 0.2f * (inpb(x, y, c)
                      + inpb(x, y - 1, c)
@@ -147,17 +167,25 @@ public:
                      - inpb(x + 1, y, c)), 255.0f));
     }
 
+    void materialize_stages() {
+        inpb.compute_root();
+    }
+
     bool schedule_for_cpu() {
         // lin.reorder(c, x, y)
         //     .bound(c, 0, 3)
         //     .unroll(c);
         // Var x_outer, x_inner, y_outer, y_inner;
         // lin.tile(x, y, x_outer, y_outer, x_inner, y_inner, 4, 4);
+
+        lin.compile_jit(bench_target(get_jit_target_from_environment()));
+        return true;
     }
 
     bool schedule_for_gpu() {
         Target target = find_gpu_target();
         if (!target.has_gpu_feature()) {
+            lin.compile_jit(bench_target(target));
             return false;
         }
 
@@ -172,83 +200,278 @@ public:
 
         //lin.gpu_tile(x, y, x_outer, y_outer, x_inner, y_inner, 8, 8);
 
-        lin.compile_jit(target);
+        lin.compile_jit(bench_target(target));
+        return true;
     }
 };
 
-#include <fstream>
-#include <vector>
-#include <string>
-void test_performance(Buffer<uint8_t> input, Func lin, std::string oname) {
+enum StencilMode { Direct, Separable, RunningSum };
+
+const char *stencil_mode_names[] = {"direct", "separable", "running_sum"};
+
+// 1D taps of a radius-r kernel; the 2D kernel is their outer product.
+std::vector<float> box_weights(int radius) {
+    return std::vector<float>(2 * radius + 1, 1.0f / (2 * radius + 1));
+}
+
+std::vector<float> gaussian_weights(int radius, float sigma) {
+    std::vector<float> weights(2 * radius + 1);
+    float total = 0.0f;
+    for (int i = -radius; i <= radius; i++) {
+        weights[i + radius] = std::exp(-(i * i) / (2.0f * sigma * sigma));
+        total += weights[i + radius];
+    }
+    for (float &w : weights) w /= total;
+    return weights;
+}
+
+// A (2r+1)x(2r+1) separable blur of inpb, evaluated one of three ways:
+//   Direct     - all K^2 taps per pixel.
+//   Separable  - a horizontal pass then a vertical one, 2K taps per pixel.
+//                Horizontal rows are stored per strip and slid down it, so
+//                each row is computed once rather than K times.
+//   RunningSum - box filter only (weights are ignored). Prefix sums run down
+//                each column and along each row, so a pixel costs a couple
+//                of subtractions whatever the radius.
+class Stencil {
+public:
+    Func blur, blur_x, col_prefix, row_prefix;
+    Var x, y, c;
+    RDom rx, ry;
+    StencilMode mode;
+    int radius;
+
+    Stencil() : blur("blur"), blur_x("blur_x"), col_prefix("col_prefix"), row_prefix("row_prefix") {}
+
+    void define(Func inpb, int width, int height, int r, const std::vector<float> &weights, StencilMode m) {
+        mode = m;
+        radius = r;
+        int k = 2 * radius + 1;
+        Buffer<float> w(k);
+        for (int i = 0; i < k; i++) w(i) = weights[i];
+
+        if (mode == Direct) {
+            RDom t(0, k, 0, k);
+            blur(x, y, c) = sum(w(t.x) * w(t.y) * cast<float>(inpb(x + t.x - radius, y + t.y - radius, c)));
+        } else if (mode == Separable) {
+            RDom t(0, k);
+            blur_x(x, y, c) = sum(w(t) * cast<float>(inpb(x + t - radius, y, c)));
+            blur(x, y, c) = sum(w(t) * blur_x(x, y + t - radius, c));
+        } else {
+            // Prefix sums start one row/column before the window first
+            // reaches, where the pure definition leaves them at zero.
+            ry = RDom(-radius, height + 2 * radius);
+            col_prefix(x, y, c) = 0;
+            col_prefix(x, ry, c) = col_prefix(x, ry - 1, c) + cast<int32_t>(inpb(x, ry, c));
+
+            rx = RDom(-radius, width + 2 * radius);
+            row_prefix(x, y, c) = 0;
+            row_prefix(rx, y, c) = row_prefix(rx - 1, y, c)
+                + col_prefix(rx, y + radius, c) - col_prefix(rx, y - radius - 1, c);
+
+            blur(x, y, c) = cast<float>(row_prefix(x + radius, y, c) - row_prefix(x - radius - 1, y, c)) / (float)(k * k);
+        }
+    }
+
+    void schedule(Func lin, Var lx, Var ly) {
+        Var yo, yi;
+        if (mode == Direct) {
+            lin.parallel(ly).vectorize(lx, 8);
+        } else if (mode == Separable) {
+            // Serial within a strip so the sliding window can reuse rows.
+            lin.split(ly, yo, yi, 32).parallel(yo).vectorize(lx, 8);
+            blur_x.store_at(lin, yo).compute_at(lin, yi).vectorize(x, 8);
+        } else {
+            col_prefix.compute_root().parallel(c).vectorize(x, 8);
+            col_prefix.update().reorder(x, ry).parallel(c).vectorize(x, 8);
+            row_prefix.compute_at(lin, ly);
+            lin.parallel(ly).vectorize(lx, 8);
+        }
+    }
+};
+
+// Same threshold rule as ConvMaskPipeline, but with a K x K blur for the
+// dark side and an unsharp mask (2 * centre - blur) for the bright side.
+class StencilMaskPipeline {
+public:
+    Func lin, mask, less, greater, inpb;
+    Var x, y, c;
+    Buffer<uint8_t> input;
+    Stencil stencil;
+    StencilMaskPipeline(Buffer<uint8_t> in, int radius, const std::vector<float> &weights, StencilMode mode)
+        : lin("lin"), mask("mask"), less("less"), greater("greater"), inpb("inpb"), input(in) {
+        Expr value = input(x, y, c);
+
+        Expr threshold = 0.5f;
+
+        // Cast it to a floating point value.
+        value = cast<float>(value);
+
+        value = value / 255.0f;
+
+        inpb(x, y, c) = BoundaryConditions::repeat_edge(input)(x, y, c);
+        stencil.define(inpb, input.width(), input.height(), radius, weights, mode);
+
+        mask(x, y, c) = cast<float>(value > threshold);
+        less(x, y, c) = stencil.blur(x, y, c);
+        greater(x, y, c) = 2.0f * cast<float>(inpb(x, y, c)) - stencil.blur(x, y, c);
+
+        lin(x, y, c) = cast<uint8_t>(clamp(mask(x, y, c) * greater(x, y, c) + (1.0f - mask(x, y, c)) * less(x, y, c), 0.0f, 255.0f));
+    }
+
+    bool schedule_for_cpu() {
+        stencil.schedule(lin, x, y);
+        lin.compile_jit(bench_target(get_jit_target_from_environment()));
+        return true;
+    }
+};
+
+class StencilBranchPipeline {
+public:
+    Func lin, inpb;
+    Var x, y, c;
+    Buffer<uint8_t> input;
+    Stencil stencil;
+    StencilBranchPipeline(Buffer<uint8_t> in, int radius, const std::vector<float> &weights, StencilMode mode)
+        : lin("lin"), inpb("inpb"), input(in) {
+        Expr value = input(x, y, c);
+
+        Expr threshold = 0.5f;
+
+        // Cast it to a floating point value.
+        value = cast<float>(value);
+
+        value = value / 255.0f;
+
+        inpb(x, y, c) = BoundaryConditions::repeat_edge(input)(x, y, c);
+        stencil.define(inpb, input.width(), input.height(), radius, weights, mode);
+
+        Expr blurred = stencil.blur(x, y, c);
+        lin(x, y, c) = cast<uint8_t>(clamp(select(value <= threshold, blurred,
+                                                  2.0f * cast<float>(inpb(x, y, c)) - blurred), 0.0f, 255.0f));
+    }
+
+    bool schedule_for_cpu() {
+        stencil.schedule(lin, x, y);
+        lin.compile_jit(bench_target(get_jit_target_from_environment()));
+        return true;
+    }
+};
+
+// Largest per-pixel difference between two outputs of the same shape.
+int max_difference(Buffer<uint8_t> a, Buffer<uint8_t> b) {
+    int worst = 0;
+    for (int c = 0; c < a.channels(); c++) {
+        for (int y = 0; y < a.height(); y++) {
+            for (int x = 0; x < a.width(); x++) {
+                worst = std::max(worst, std::abs((int)a(x, y, c) - (int)b(x, y, c)));
+            }
+        }
+    }
+    return worst;
+}
+
+// The modes only differ in summation order, so every one must land within 1
+// of the direct form (which is evaluated first and kept as the reference).
+// Returns false for a mode that doesn't, so it never gets timed.
+bool matches_direct(Func lin, Buffer<uint8_t> input, StencilMode mode, Buffer<uint8_t> &reference, const std::string &name) {
     Buffer<uint8_t> output(input.width(), input.height(), input.channels());
     lin.realize(output);
-    output.copy_to_host();
-    save_image(output, oname + "_conv.png");
-    //lin.compile_to_lowered_stmt(oname + "_conv.html", lin.infer_arguments(), HTML);
-    
-    // warmup
-    int n = 1000;
-    for (int i = 0; i < n; i++) {
-        lin.realize(output);
-        output.copy_to_host();
-    }
-    std::vector<double> v;
-    for (int i = 0; i < n; i++) {
-        high_resolution_clock::time_point t1 = high_resolution_clock::now();
-        lin.realize(output);
-        output.copy_to_host();
-        high_resolution_clock::time_point t2 = high_resolution_clock::now();
-
-        duration<double> time_span = duration_cast<duration<double>>(t2 - t1);
-        double avg_time = time_span.count();
-        v.push_back(avg_time);
-    }
-    double sum = std::accumulate(v.begin(), v.end(), 0.0);
-    double mean = sum / v.size();
-
-    double sq_sum = std::inner_product(v.begin(), v.end(), v.begin(), 0.0);
-    double stdev = std::sqrt(sq_sum / v.size() - mean * mean);
-    printf("Mean: %1.6f seconds\n", mean);
-    printf("Std dev: %1.6f seconds\n", stdev);
-    printf("N: %d\n", n);
-
-    if (oname != "") {
-        std::ofstream outFile(oname + "_conv.txt");
-        // the important part
-        for (const auto &e : v) outFile << e << "\n";
+    if (mode == Direct) {
+        reference = output;
+        return true;
     }
+    int diff = max_difference(output, reference);
+    if (diff > 1) {
+        printf("%s differs from the direct form by up to %d\n", name.c_str(), diff);
+        return false;
+    }
+    return true;
 }
 
-void test_performance(Buffer<uint8_t> input, Func lin) {
-    test_performance(input, lin, "");
+// Box and Gaussian kernels at each radius through every stencil mode, in
+// both flavours. The running sum only implements a box, so it skips Gaussians.
+bool benchmark_stencils(Buffer<uint8_t> input) {
+    const int radii[] = {3, 7, 11, 15};
+    const std::string kernels[] = {"box", "gaussian"};
+    for (int radius : radii) {
+        for (const std::string &kernel : kernels) {
+            std::vector<float> weights = kernel == "box" ? box_weights(radius) : gaussian_weights(radius, radius / 2.0f);
+            Buffer<uint8_t> branch_reference, pred_reference;
+            for (int m = Direct; m <= RunningSum; m++) {
+                StencilMode mode = (StencilMode)m;
+                if (mode == RunningSum && kernel != "box") continue;
+                std::string config = kernel + "_r" + std::to_string(radius) + "_" + stencil_mode_names[mode];
+
+                StencilBranchPipeline branch(input, radius, weights, mode);
+                branch.schedule_for_cpu();
+                if (!matches_direct(branch.lin, input, mode, branch_reference, "branch_" + config)) return false;
+                printf("Branch %s avg runtime (%dx):\n", config.c_str(), bench_opts.iterations);
+                test_performance(input, branch.lin, "renders/cpu_branch_" + config);
+
+                StencilMaskPipeline pred(input, radius, weights, mode);
+                pred.schedule_for_cpu();
+                if (!matches_direct(pred.lin, input, mode, pred_reference, "pred_" + config)) return false;
+                printf("Branch-free %s avg runtime (%dx):\n", config.c_str(), bench_opts.iterations);
+                test_performance(input, pred.lin, "renders/cpu_pred_" + config);
+            }
+        }
+    }
+    return true;
 }
 
 
 int main(int argc, char **argv) {
+    bench_opts.kernel = "conv";
+    bool stencil = false;
+    for (int i = 2; i < argc; i++) {
+        if (std::string(argv[i]) == "--stencil") {
+            stencil = true;
+            continue;
+        }
+        if (!parse_bench_option(argc, argv, i)) {
+            printf("Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (argc > 1 && bench_opts.stream_width > 0) {
+        stream_variants<ConvBranchPipeline, ConvMaskPipeline>(argv[1]);
+        return 0;
+    }
+
     if (argc > 1) {
         Buffer<uint8_t> input = load_image(argv[1]);
+        if (stencil) {
+            return benchmark_stencils(input) ? 0 : 1;
+        }
+
         printf("CPU:\n");
 
         ConvBranchPipeline cpu_lbp(input);
+        if (bench_opts.profile_stages) cpu_lbp.materialize_stages();
         cpu_lbp.schedule_for_cpu();
-        printf("Branch pipeline avg runtime (1000x):\n");
+        printf("Branch pipeline avg runtime (%dx):\n", bench_opts.iterations);
         test_performance(input, cpu_lbp.lin, "renders/cpu_branch");
 
         ConvMaskPipeline cpu_lmp(input);
+        if (bench_opts.profile_stages) cpu_lmp.materialize_stages();
         cpu_lmp.schedule_for_cpu();
-        printf("Branch-free pipeline avg runtime (1000x):\n");
+        printf("Branch-free pipeline avg runtime (%dx):\n", bench_opts.iterations);
         test_performance(input, cpu_lmp.lin, "renders/cpu_pred");
 
         printf("\nGPU:\n");
 
         ConvBranchPipeline gpu_lbp(input);
+        if (bench_opts.profile_stages) gpu_lbp.materialize_stages();
         gpu_lbp.schedule_for_gpu();
-        printf("Branch pipeline avg runtime (1000x):\n");
+        printf("Branch pipeline avg runtime (%dx):\n", bench_opts.iterations);
         test_performance(input, gpu_lbp.lin, "renders/gpu_branch");
 
         ConvMaskPipeline gpu_lmp(input);
+        if (bench_opts.profile_stages) gpu_lmp.materialize_stages();
         gpu_lmp.schedule_for_gpu();
-        printf("Branch-free pipeline avg runtime (1000x):\n");
+        printf("Branch-free pipeline avg runtime (%dx):\n", bench_opts.iterations);
         test_performance(input, gpu_lmp.lin, "renders/gpu_pred");
     }
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 // g++ linearize_test.cpp -g -I ~/Halide10/include/ -I ~/Halide10/share/Halide/tools/ -L ~/Halide10/lib/ -lHalide `libpng-config --cflags --ldflags` -ljpeg -lpthread -ldl -o linearize_test -std=c++11
 // LD_LIBRARY_PATH=~/Halide10/lib/ ./linearize_test images/rgb.png
 
+// Options after the image path are listed in bench_common.h.
+
 #include "Halide.h"
 
 #include <chrono>
@@ -11,6 +13,8 @@
 
 // Include some support code for loading pngs.
 #include "halide_image_io.h"
+// Options, profiling, the buffer pool and the timing/streaming harness.
+#include "bench_common.h"
 // #include <filesystem>
 #include <string>
 #include <iostream>
@@ -58,11 +62,11 @@ Target find_gpu_target() {
 
 class LinearizeMaskPipeline {
 public:
-    Func lin;
+    Func lin, mask, less, greater;
     Var x, y, c, x_outer, x_inner, y_outer, y_inner;
     Buffer<uint8_t> input;
-    LinearizeMaskPipeline(Buffer<uint8_t> in) : input(in) {
-        Func mask, less, greater;
+    LinearizeMaskPipeline(Buffer<uint8_t> in)
+        : lin("lin"), mask("mask"), less("less"), greater("greater"), input(in) {
         Expr value = input(x, y, c);
 
         Expr threshold = 0.5f; //0.0404482f;
@@ -88,24 +92,37 @@ public:
         lin(x, y, c) = value;
     }
 
+    // Inlined Funcs are folded into lin by the profiler, so give every
+    // intermediate its own buffer to see what each stage costs on its own.
+    void materialize_stages() {
+        mask.compute_root();
+        less.compute_root();
+        greater.compute_root();
+    }
+
     bool schedule_for_cpu() {
         // lin.reorder(c, x, y)
         //     .bound(c, 0, 3)
         //     .unroll(c);
         // Var x_outer, x_inner, y_outer, y_inner;
         // lin.tile(x, y, x_outer, y_outer, x_inner, y_inner, 4, 4);
+
+        lin.compile_jit(bench_target(get_jit_target_from_environment()));
+        return true;
     }
 
     bool schedule_for_gpu() {
         Target target = find_gpu_target();
         if (!target.has_gpu_feature()) {
+            lin.compile_jit(bench_target(target));
             return false;
         }
 
         Var x_outer, x_inner, y_outer, y_inner;
         lin.gpu_tile(x, y, x_outer, y_outer, x_inner, y_inner, 8, 8);
 
-        lin.compile_jit(target);
+        lin.compile_jit(bench_target(target));
+        return true;
     }
 };
 
@@ -114,7 +131,7 @@ public:
     Func lin;
     Var x, y, c, x_outer, x_inner, y_outer, y_inner;
     Buffer<uint8_t> input;
-    LinearizeBranchPipeline(Buffer<uint8_t> in) : input(in) {
+    LinearizeBranchPipeline(Buffer<uint8_t> in) : lin("lin"), input(in) {
         
         Expr value = input(x, y, c);
 
@@ -143,92 +160,64 @@ public:
         //     .unroll(c);
         // Var x_outer, x_inner, y_outer, y_inner;
         // lin.tile(x, y, x_outer, y_outer, x_inner, y_inner, 4, 4);
+
+        lin.compile_jit(bench_target(get_jit_target_from_environment()));
+        return true;
     }
 
     bool schedule_for_gpu() {
         Target target = find_gpu_target();
         if (!target.has_gpu_feature()) {
+            lin.compile_jit(bench_target(target));
             return false;
         }
 
         Var x_outer, x_inner, y_outer, y_inner;
         lin.gpu_tile(x, y, x_outer, y_outer, x_inner, y_inner, 8, 8);
 
-        lin.compile_jit(target);
+        lin.compile_jit(bench_target(target));
+        return true;
     }
 };
 
-#include <fstream>
-#include <vector>
-#include <string>
-void test_performance(Buffer<uint8_t> input, Func lin, std::string oname) {
-    Buffer<uint8_t> output(input.width(), input.height(), input.channels());
-    lin.realize(output);
-    output.copy_to_host();
-    save_image(output, oname + "_linearize.png");
-    //lin.compile_to_lowered_stmt(oname + "_linearize.html", lin.infer_arguments(), HTML);
-    
-    // warmup
-    int n = 1000;
-    for (int i = 0; i < n; i++) {
-        lin.realize(output);
-        output.copy_to_host();
-    }
-    std::vector<double> v;
-    for (int i = 0; i < n; i++) {
-        high_resolution_clock::time_point t1 = high_resolution_clock::now();
-        lin.realize(output);
-        output.copy_to_host();
-        high_resolution_clock::time_point t2 = high_resolution_clock::now();
-
-        duration<double> time_span = duration_cast<duration<double>>(t2 - t1);
-        double avg_time = time_span.count();
-        v.push_back(avg_time);
-    }
-    double sum = std::accumulate(v.begin(), v.end(), 0.0);
-    double mean = sum / v.size();
-
-    double sq_sum = std::inner_product(v.begin(), v.end(), v.begin(), 0.0);
-    double stdev = std::sqrt(sq_sum / v.size() - mean * mean);
-    printf("Mean: %1.6f seconds\n", mean);
-    printf("Std dev: %1.6f seconds\n", stdev);
-    printf("N: %d\n", n);
-
-    if (oname != "") {
-        std::ofstream outFile(oname + "_linearize.txt");
-        // the important part
-        for (const auto &e : v) outFile << e << "\n";
+int main(int argc, char **argv) {
+    bench_opts.kernel = "linearize";
+    for (int i = 2; i < argc; i++) {
+        if (!parse_bench_option(argc, argv, i)) {
+            printf("Unknown option: %s\n", argv[i]);
+            return 1;
+        }
     }
-}
-
-void test_performance(Buffer<uint8_t> input, Func lin) {
-    test_performance(input, lin, "");
-}
 
+    if (argc > 1 && bench_opts.stream_width > 0) {
+        stream_variants<LinearizeBranchPipeline, LinearizeMaskPipeline>(argv[1]);
+        return 0;
+    }
 
-int main(int argc, char **argv) {
     if (argc > 1) {
         Buffer<uint8_t> input = load_image(argv[1]);
         printf("CPU:\n");
         LinearizeBranchPipeline cpu_lbp(input);
         cpu_lbp.schedule_for_cpu();
-        printf("Branch pipeline avg runtime (1000x):\n");
+        printf("Branch pipeline avg runtime (%dx):\n", bench_opts.iterations);
         test_performance(input, cpu_lbp.lin, "renders/cpu_branch");
 
         LinearizeMaskPipeline cpu_lmp(input);
+        if (bench_opts.profile_stages) cpu_lmp.materialize_stages();
         cpu_lmp.schedule_for_cpu();
-        printf("Branch-free pipeline avg runtime (1000x):\n");
+        printf("Branch-free pipeline avg runtime (%dx):\n", bench_opts.iterations);
         test_performance(input, cpu_lmp.lin, "renders/cpu_pred");
 
         printf("\nGPU:\n");
         LinearizeBranchPipeline gpu_lbp(input);
         gpu_lbp.schedule_for_gpu();
-        printf("Branch pipeline avg runtime (1000x):\n");
+        printf("Branch pipeline avg runtime (%dx):\n", bench_opts.iterations);
         test_performance(input, gpu_lbp.lin, "renders/gpu_branch");
 
         LinearizeMaskPipeline gpu_lmp(input);
+        if (bench_opts.profile_stages) gpu_lmp.materialize_stages();
         gpu_lmp.schedule_for_gpu();
-        printf("Branch-free pipeline avg runtime (1000x):\n");
+        printf("Branch-free pipeline avg runtime (%dx):\n", bench_opts.iterations);
         test_performance(input, gpu_lmp.lin, "renders/gpu_pred");
     }
 
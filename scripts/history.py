@@ -0,0 +1,170 @@
+import argparse
+import glob
+import hashlib
+import json
+import os
+import platform
+import subprocess
+import sys
+import time
+
+import numpy as np
+
+from scipy import stats
+
+renders = "../renders"
+history_file = f"{renders}/history.jsonl"
+
+
+def host_fingerprint():
+    cpu = platform.processor()
+    if os.path.exists("/proc/cpuinfo"):
+        for line in open("/proc/cpuinfo"):
+            if line.startswith("model name"):
+                cpu = line.split(":", 1)[1].strip()
+                break
+    host = {
+        "node": platform.node(),
+        "system": platform.system(),
+        "machine": platform.machine(),
+        "cpu": cpu,
+        "cores": os.cpu_count(),
+    }
+    host["id"] = hashlib.sha1(json.dumps(host, sort_keys=True).encode()).hexdigest()[:12]
+    return host
+
+
+def load_history():
+    if not os.path.exists(history_file):
+        return []
+    with open(history_file) as f:
+        return [json.loads(line) for line in f if line.strip()]
+
+
+def key(entry):
+    return (entry["kernel"], entry["variant"], entry["schedule"], entry["target"], entry.get("flags", ""),
+            entry["host"]["id"])
+
+
+# Append every renders/<variant>_<kernel>.json summary written by the drivers,
+# along with its per-iteration samples, to the history file. Each result is
+# filed under the commit the driver recorded when it ran (bench_commit() in
+# bench_common.h); results from drivers that didn't record one are skipped.
+# Result files that were already recorded (same name and modification time)
+# are skipped too. Traced runs time a single instrumented iteration and are
+# never recorded.
+def record(args):
+    host = host_fingerprint()
+    seen = {(e["kernel"], e["variant"], e["result_time"]) for e in load_history()}
+    count = 0
+    unversioned = 0
+    with open(history_file, "a") as out:
+        for path in sorted(glob.glob(f"{renders}/*.json")):
+            summary = json.load(open(path))
+            result_time = os.path.getmtime(path)
+            if args.kernel and summary["kernel"] != args.kernel:
+                continue
+            if (summary["kernel"], summary["variant"], result_time) in seen:
+                continue
+            flags = summary.get("flags", "")
+            if "trace" in flags.split(","):
+                continue
+            if not summary.get("commit"):
+                unversioned += 1
+                continue
+            samples = np.loadtxt(path[:-len(".json")] + ".txt", ndmin=1)
+            entry = {
+                "time": time.strftime("%Y-%m-%dT%H:%M:%S"),
+                "result_time": result_time,
+                "commit": summary["commit"],
+                "kernel": summary["kernel"],
+                "variant": summary["variant"],
+                "schedule": args.schedule,
+                "target": summary["target"],
+                "flags": flags,
+                "host": host,
+                "n": summary["n"],
+                "mean": summary["mean"],
+                "stdev": summary["stdev"],
+                "samples": samples.tolist(),
+            }
+            out.write(json.dumps(entry) + "\n")
+            count += 1
+    print(f"Recorded {count} results on host {host['id']}")
+    if unversioned:
+        print(f"Skipped {unversioned} results with no recorded commit; rerun the drivers to record them")
+
+
+# Expand a commit as given on the command line to the full hash recorded in
+# the history. Dirty runs are only selected with an explicit -dirty suffix.
+def resolve(commit):
+    dirty = commit.endswith("-dirty")
+    rev = commit[:-len("-dirty")] if dirty else commit
+    try:
+        rev = subprocess.check_output(["git", "rev-parse", "--verify", "--quiet", rev + "^{commit}"],
+                                      text=True, stderr=subprocess.DEVNULL).strip()
+    except subprocess.CalledProcessError:
+        pass
+    return rev + ("-dirty" if dirty else "")
+
+
+def latest(entries, commit):
+    runs = {}
+    for e in entries:
+        if e["commit"] == commit:
+            runs[key(e)] = e
+    return runs
+
+
+# Welch's t-test (as in compute_ttest.py) between the latest baseline and
+# candidate runs of every configuration they share. A configuration counts as
+# a regression when it is significantly slower by more than --threshold.
+def compare(args):
+    entries = load_history()
+    if not entries:
+        print(f"No history in {history_file}")
+        return 2
+    baseline = resolve(args.baseline)
+    candidate = resolve(args.candidate) if args.candidate else entries[-1]["commit"]
+    base = latest(entries, baseline)
+    cand = latest(entries, candidate)
+    if not base:
+        print(f"No results recorded for baseline {baseline}")
+        return 2
+    shared = sorted(set(base) & set(cand))
+    if not shared:
+        print(f"Baseline {baseline} and candidate {candidate} have no configuration in common")
+        return 2
+
+    regressions = 0
+    for k in shared:
+        b, c = base[k], cand[k]
+        t = stats.ttest_ind(c["samples"], b["samples"], equal_var=False)
+        change = c["mean"] / b["mean"] - 1.0
+        slower = t.pvalue < args.alpha and change > args.threshold
+        regressions += slower
+        print(f"{'REGRESSION' if slower else 'ok':10s} {k[0]:10s} {k[1]:32s} {k[2]:10s} {k[3]:24s} {k[4] or '-':16s} "
+              f"{b['mean']:.6f} -> {c['mean']:.6f} ({change:+.1%}, p={t.pvalue:.2g})")
+
+    print(f"{regressions} regression(s) of {len(shared)} compared, {baseline} -> {candidate}")
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Benchmark history and regression checks.")
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("record", help="append the current renders/*.json results to the history")
+    p.add_argument("--kernel", help="only record this kernel (conv, linearize, pixel)")
+    p.add_argument("--schedule", default="default", help="label for the schedule that was benchmarked")
+    p.set_defaults(func=record)
+
+    p = sub.add_parser("compare", help="flag regressions against a baseline commit")
+    p.add_argument("baseline", help="baseline commit (any revision git understands; add -dirty for dirty runs)")
+    p.add_argument("--candidate", help="candidate commit, same form (default: most recently recorded)")
+    p.add_argument("--alpha", type=float, default=0.01, help="significance level")
+    p.add_argument("--threshold", type=float, default=0.05, help="minimum relative slowdown to report")
+    p.set_defaults(func=compare)
+
+    args = parser.parse_args()
+    sys.exit(args.func(args) or 0)